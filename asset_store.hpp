@@ -0,0 +1,126 @@
+/*
+This file contains the asset_store class.
+
+It is a read-optimized key -> blob store meant to be shared by every worker thread (for example the images of the gallery).
+The design is RCU-like:
+	-The current content is an immutable snapshot (a std::map) reached through a single atomic pointer.
+	-Readers load the pointer and look up the snapshot directly. No lock is taken and nothing is copied,
+	the blobs are refcounted (std::shared_ptr<const std::string>) so a reader can keep one alive after the lookup.
+	-Writers are serialized by a mutex, copy the current snapshot, add to the copy and publish it with a single atomic store.
+	Many assets loaded at once (for example at startup) should go through insert_all, which copies and publishes only once.
+
+A replaced snapshot is freed by the writer once no reader can still be looking at it (a grace period):
+	-Readers register on one of two counters, picked by the parity of an epoch, for as long as they use a snapshot (see reader).
+	-After publishing, the writer flips the epoch so that new readers use the other counter, and waits for the old one to drop to 0.
+	Those new readers can only see the new snapshot, so the old one is freed right after.
+Lookups are short so the wait is too, a reader that iterates the whole store (reader::snapshot) delays the writers as long as it runs.
+*/
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class asset_store{
+public:
+	typedef std::shared_ptr<const std::string> blob;
+	typedef std::map <std::string, blob> snapshot_type;
+
+	class reader{//keep the current snapshot alive while this object lives, it must not outlive the store
+	public:
+		reader(const asset_store &store): store(store){
+			while(true){
+				parity = store.epoch.load() & 1;
+				store.readers[parity]++;
+				if((store.epoch.load() & 1) == parity){
+					break;
+				}
+				store.readers[parity]--;//a writer flipped the epoch meanwhile and may not wait for this counter, register again
+			}
+			snap = store.current.load();
+		}
+		~reader(){
+			store.readers[parity]--;
+		}
+		reader(const reader&) = delete;
+		reader& operator=(const reader&) = delete;
+
+		const snapshot_type& snapshot() const{
+			return *snap;
+		}
+	private:
+		const asset_store &store;
+		unsigned parity;
+		const snapshot_type *snap;
+	};
+
+	asset_store(): current(new snapshot_type()), epoch(0){
+		readers[0] = 0;
+		readers[1] = 0;
+	}
+
+	~asset_store(){
+		delete current.load();
+	}
+
+	asset_store(const asset_store&) = delete;
+	asset_store& operator=(const asset_store&) = delete;
+
+	blob find(const std::string &key) const{//return nullptr if the key is not found
+		reader r(*this);
+		auto it = r.snapshot().find(key);
+		if(it == r.snapshot().end()){
+			return nullptr;
+		}
+		return it->second;
+	}
+
+	bool contains(const std::string &key) const{
+		reader r(*this);
+		return r.snapshot().find(key) != r.snapshot().end();
+	}
+
+	bool insert(const std::string &key, std::string &&value){//return false (and do nothing) if the key already exists
+		std::map <std::string, std::string> one;
+		one.emplace(key, std::move(value));
+		return insert_all(std::move(one)) == 1;
+	}
+
+	int insert_all(std::map <std::string, std::string> &&values){//add every new key in a single snapshot, return how many were added
+		std::lock_guard <std::mutex> lock(write_mutex);
+		const snapshot_type *old = current.load(std::memory_order_relaxed);//only writers change it, and we hold the lock
+		snapshot_type *next = NULL;
+		int added = 0;
+		for(auto &v: values){
+			if(old->find(v.first) != old->end()){
+				continue;
+			}
+			if(next == NULL){
+				next = new snapshot_type(*old);
+			}
+			(*next)[v.first] = std::make_shared<const std::string>(std::move(v.second));
+			added++;
+		}
+		if(next != NULL){
+			current.store(next);//publish
+			wait_for_readers();
+			delete old;
+		}
+		return added;
+	}
+
+private:
+	std::atomic <const snapshot_type*> current;
+	std::mutex write_mutex;
+	//grace period tracking, every operation is sequentially consistent so that a reader either registers before the flip or sees the new snapshot
+	std::atomic <unsigned> epoch;
+	mutable std::atomic <int> readers[2];
+
+	void wait_for_readers(){//called with write_mutex held, after publishing
+		unsigned old_parity = epoch.fetch_add(1) & 1;
+		while(readers[old_parity].load() != 0){
+			std::this_thread::yield();
+		}
+	}
+};
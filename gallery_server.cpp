@@ -6,48 +6,79 @@ This weird way of adding image is due to the server not supporting multipart rea
 More precisely:
 	The server support GET request for images and html pages
 	The server support POST request for texts, which will be interpreted as image link, download and saved to disk. 
+	The download runs on the blocking pool so that it does not hold up a worker thread.
+	Requests under /api/ are forwarded to the backends given after the usual arguments (502 if there is none).
 */
 #include <bits/stdc++.h>
+#include <spawn.h>
+#include <sys/wait.h>
 using namespace std;
 #include "http_server.hpp"
 #include "html_template.hpp"
+#include "asset_store.hpp"
+#include "http_proxy.hpp"
 html_template gallery_template("./template/gallery_template.html");
 html_template image_embed("./template/image_embed.html");
 class gallery_server: public http_server{
 public:
-	using http_server::http_server;
-	map <string, string> imgs;//store the image as a string containing binary data
+	http_proxy api;
+	
+	gallery_server(int port, int max_concurrent_connection, int max_worker_thread, const vector <string> &api_backends):
+	http_server(port, max_concurrent_connection, max_worker_thread), api("/api/", api_backends, http_proxy::LEAST_OUTSTANDING){}
+	
+	asset_store imgs;//store the image as a string containing binary data, read by every worker without locking
+	
+	static string read_image(const string &s){
+		ifstream imgfile("./image/" + s, ios::binary);
+		return string((std::istreambuf_iterator<char>(imgfile)), (std::istreambuf_iterator<char>()));
+	}
 	
 	void load_image(const string &s){
-		if(imgs.find(s) != imgs.end()){
+		if(imgs.contains(s)){
 			return;
 		}
-		string res;
-		ifstream imgfile("./image/" + s, ios::binary);
-		std::vector<char> buffer((std::istreambuf_iterator<char>(imgfile)), (std::istreambuf_iterator<char>()));
-		for(char &c: buffer){
-			res += c;
+		string content = read_image(s);
+		if(!content.empty()){//missing or empty file, nothing worth keeping
+			imgs.insert(s, std::move(content));
 		}
-		imgs[s] = res;
 	}
 	
-	void load_images(){
+	void load_images(){//all in one snapshot
 		system("ls image -1 > img_list.out");
 		ifstream f("img_list.out");
 		string s;
+		map <string, string> loaded;
 		while(getline(f, s)){
-			load_image(s);
+			loaded[s] = read_image(s);
 		}
+		imgs.insert_all(std::move(loaded));
 	}
 	
 	string render_gallery(){
 		string res = "";
-		for(auto &x: imgs){
+		asset_store::reader images(imgs);//the snapshot stays valid until the end of the function
+		for(auto &x: images.snapshot()){
 			res = image_embed.render({res, "image/" + x.first});
 		}
 		return gallery_template.render({res});
 	}
 	
+	static int download(const string &link, const string &path){//run curl without a shell, return its exit status (0 on success)
+		pid_t pid;
+		const char *argv[] = {"curl", "--fail", "--silent", link.c_str(), "--output", path.c_str(), NULL};//--fail: an http error is not saved as the image
+		if(posix_spawnp(&pid, "curl", NULL, NULL, (char* const*)argv, environ) != 0){
+			return -1;
+		}
+		int status;
+		if(waitpid(pid, &status, 0) < 0){
+			return -1;
+		}
+		if(status != 0){
+			unlink(path.c_str());//whatever was written is not an image
+		}
+		return status;
+	}
+	
 	vector <string> parse_uri(const string &uri){
 		int i;
 		string category = "";
@@ -67,21 +98,26 @@ public:
 		return {category, resource};
 	}
 	
-	int handle_request(http_socket &sock){
+	task<int> handle_request_async(http_socket &sock){
+		if(api.matches(sock.request.uri)){
+			auto forwarding = api.forward_async(sock);
+			co_return co_await forwarding;
+		}
 		http_response res;
 		if(sock.request.type == "GET"){
 			auto info = parse_uri(sock.request.uri);
 			if(info[0] == "image"){
-				if(imgs.find(info[1]) == imgs.end()){
+				auto img = imgs.find(info[1]);
+				if(!img){
 					res.status_code = "404";
-					res.reason_phrase = "Not found";
+					res.reason_phrase = "Not Found";
 				}
 				else{
 					res.status_code = "200";
 					res.reason_phrase = "OK";
 					res.headers["Cache-Control"] = "public, max-age=604800, immutable";
 					res.headers["Content-Type"] = "image";
-					res.content = imgs[info[1]];
+					res.shared_content = img;
 				}
 			}
 			else if(info[0] == "home"){
@@ -90,7 +126,7 @@ public:
 			}
 			else{//404
 				res.status_code = "404";
-				res.reason_phrase = "Not found";
+				res.reason_phrase = "Not Found";
 			}
 		}
 		else if(sock.request.type == "POST"){
@@ -120,40 +156,49 @@ public:
 					if(file_name == link){
 						valid = false;
 					}
-					else if(imgs.find(file_name) != imgs.end()){
+					else if(imgs.contains(file_name)){
 						valid = false;
 					}
 				}
 				if(valid){
-					system(("curl " + link + " --output image/" + file_name).c_str());
-					load_image(file_name);
+					//the awaiter is kept in a named variable, gcc 12 destroys lambda temporaries inside a co_await expression twice
+					auto fetch = offload_pool.run([this, link, file_name]{
+						if(download(link, "image/" + file_name) == 0){//a failed download is not kept in memory
+							load_image(file_name);
+						}
+						return 0;
+					});
+					co_await fetch;
 					res.content = render_gallery();
 				}
 				else{
 					res.status_code = "400";
-					res.reason_phrase = "Bad request";
+					res.reason_phrase = "Bad Request";
 				}
 			}
 			else{
 				res.status_code = "404";
-				res.reason_phrase = "Not found";
+				res.reason_phrase = "Not Found";
 			}
 		}
 		else{
 			res.status_code = "501";
-			res.reason_phrase = "Not implemented";
+			res.reason_phrase = "Not Implemented";
 		}
-		sock.send_message(res);
-		return 0;
+		auto sending = sock.async_send_message(io, res);//a slow client does not hold the thread either
+		co_await sending;
+		co_return 0;
 	}
 };
 
 int main(int argc, char* argv[]){
-	if(argc != 4){
-		cerr << "Provide the port, the concurrent connection cap, and the number of worker thread!\n";
+	if(argc < 4){
+		cerr << "Provide the port, the concurrent connection cap, and the number of worker thread (then optionally host:port backends for /api/)!\n";
 		return -1;
 	}
-	gallery_server cs(atoll(argv[1]), atoll(argv[2]), atoll(argv[3]));//port, cuncurrent connection cap, worker thread
+	vector <string> api_backends(argv + 4, argv + argc);
+	gallery_server cs(atoll(argv[1]), atoll(argv[2]), atoll(argv[3]), api_backends);//port, cuncurrent connection cap, worker thread, backends
 	cs.load_images();
+	cs.enable_reload(argv);//SIGHUP starts the binary on disk again and hands it the listening socket
 	cs.start();
 }
\ No newline at end of file
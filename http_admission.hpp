@@ -0,0 +1,145 @@
+/*
+This file contains the admission control used by http_server to stay responsive under overload.
+
+When more work arrives than the workers can handle, the queues in handle_connections would grow without bound
+and every client would see its latency rise until it times out. Instead, the epoll thread refuses some work early
+with small prebuilt responses, so that the requests it does admit are still served quickly:
+	-New connections waiting to be added to epoll are capped, extra ones get a 503.
+	-Each request remembers when it was queued. The time it waited is checked when it is handed to a worker (CoDel style):
+	if even the shortest wait over the last interval is above the target, the queue is standing and requests
+	that waited longer than the target are answered with a 503. Otherwise only requests that waited longer than a whole interval are.
+	Like CoDel, this state is left as soon as the queue empties, and entered again right away if the queue fills back up within an interval.
+	-Each client IP has a token bucket, a request without a token gets a 429.
+
+Everything here is only touched by the epoll thread, so there is no locking.
+The defaults come from http_define.hpp and can be changed before start().
+*/
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+class queue_delay_monitor{//CoDel-style decision on whether a queued request should be shed
+public:
+	int64_t target_us, interval_us;
+
+	queue_delay_monitor(int64_t target_us, int64_t interval_us):
+	target_us(target_us), interval_us(interval_us), interval_start(0), min_delay(INT64_MAX), left_at(INT64_MIN / 2), overloaded(false){}
+
+	bool should_shed(int64_t now, int64_t delay){
+		if(min_delay == INT64_MAX){//first sample since the queue was empty, an interval starts
+			interval_start = now;
+		}
+		else if(now - interval_start >= interval_us){//end of an interval, was the queue standing during it?
+			overloaded = min_delay > target_us;
+			min_delay = INT64_MAX;
+			interval_start = now;
+		}
+		if(!overloaded && delay > target_us && now - left_at < interval_us){
+			//the queue was only empty for a moment (shedding emptied it), it is standing again. CoDel re-enters quickly too
+			overloaded = true;
+		}
+		if(delay < min_delay){
+			min_delay = delay;
+		}
+		return delay > (overloaded ? target_us : interval_us);
+	}
+
+	void queue_empty(int64_t now){//there is no standing queue anymore, the next sample starts afresh
+		if(overloaded){
+			overloaded = false;
+			left_at = now;
+		}
+		min_delay = INT64_MAX;
+	}
+
+	bool is_overloaded() const{
+		return overloaded;
+	}
+private:
+	int64_t interval_start, min_delay;//min_delay is INT64_MAX while no sample was taken in the current interval
+	int64_t left_at;//when the queue last emptied while overloaded, long ago at first
+	bool overloaded;
+};
+
+class rate_limiter{//token bucket per client IPv4 address, kept in a small open addressing table
+public:
+	double rate_per_second, burst;//rate_per_second <= 0 disables the limit
+
+	rate_limiter(double rate_per_second, double burst, int table_size):
+	rate_per_second(rate_per_second), burst(burst), mask(table_size - 1), table(table_size){}//table_size must be a power of 2
+
+	bool allow(uint32_t ip, int64_t now){//take a token from this ip's bucket, return false if there is none
+		if(rate_per_second <= 0){
+			return true;
+		}
+		bucket &b = find(ip, now);
+		b.tokens += (now - b.last_us) * rate_per_second / 1000000;
+		if(b.tokens > burst){
+			b.tokens = burst;
+		}
+		b.last_us = now;
+		if(b.tokens < 1){
+			return false;
+		}
+		b.tokens--;
+		return true;
+	}
+private:
+	static const int PROBE_LIMIT = 8;
+	struct bucket{
+		uint32_t ip;
+		bool used;
+		double tokens;
+		int64_t last_us;
+	};
+	const uint32_t mask;
+	std::vector <bucket> table;
+
+	bucket& find(uint32_t ip, int64_t now){
+		uint32_t h = (ip * 2654435761u) & mask;//multiplicative hashing
+		bucket *oldest = &table[h];
+		for(int i = 0; i < PROBE_LIMIT; i++){
+			bucket &b = table[(h + i) & mask];
+			if(b.used && b.ip == ip){
+				return b;
+			}
+			if(!b.used){
+				oldest = &b;
+				break;
+			}
+			if(b.last_us < oldest->last_us){
+				oldest = &b;
+			}
+		}
+		//new client, or the neighbourhood is full and the least recently seen client is forgotten (it gets a full bucket back)
+		oldest->ip = ip;
+		oldest->used = true;
+		oldest->tokens = burst;
+		oldest->last_us = now;
+		return *oldest;
+	}
+};
+
+class admission_control{
+public:
+	size_t max_pending_connection;//accepted connections waiting for a slot in epoll
+	queue_delay_monitor queue_delay;
+	rate_limiter limiter;
+
+	//prebuilt responses, the connection is closed right after them
+	const std::string overloaded_response =
+		"HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+	const std::string rate_limited_response =
+		"HTTP/1.1 429 Too Many Requests\r\nConnection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+
+	admission_control(): max_pending_connection(MAX_PENDING_CONNECTION),
+	queue_delay(QUEUE_DELAY_TARGET_US, QUEUE_DELAY_INTERVAL_US),
+	limiter(CLIENT_RATE_PER_SECOND, CLIENT_RATE_BURST, CLIENT_RATE_TABLE_SIZE){}
+
+	static int64_t now_us(){
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+};
@@ -4,4 +4,23 @@ This file defines a collection of constants.
 #define SOCKET_STARTING_BUFFER_SIZE 4096
 #define MAX_FD_VALUE 16384
 #define PIPE_READ 0
-#define PIPE_WRITE 1
\ No newline at end of file
+#define PIPE_WRITE 1
+#define BLOCKING_QUEUE_SIZE 1024
+#define RESUME_THREAD_COUNT 2 //threads resuming the handlers woken up by a timer or an fd, see http_task.hpp
+//admission control defaults, see http_admission.hpp
+#define MAX_PENDING_CONNECTION 4096
+#define QUEUE_DELAY_TARGET_US 5000
+#define QUEUE_DELAY_INTERVAL_US 100000
+#define CLIENT_RATE_PER_SECOND 2000
+#define CLIENT_RATE_BURST 4000
+#define CLIENT_RATE_TABLE_SIZE 4096
+//stopping and reloading, see http_server.hpp
+#define LISTEN_FD_ENV "HTTP_SERVER_LISTEN_FD"
+#define DRAIN_CONNECTIONS 65535 //sent on the connection pipe instead of an fd
+#define DRAIN_TIMEOUT_US 30000000
+#define ACCEPT_BATCH 64 //connections accepted between two checks for a signal
+//reverse proxy, see http_proxy.hpp
+#define PROXY_TIMEOUT_MS 30000
+#define PROXY_BUFFER_SIZE 16384
+#define PROXY_MAX_IDLE_PER_UPSTREAM 64
+#define PROXY_THREAD_COUNT 64 //upstream requests in flight at once, per http_proxy
\ No newline at end of file
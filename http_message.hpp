@@ -4,13 +4,58 @@ This file contains the http_message base class, the http_request class, and the
 To serve a webpage, the server are expected to generate a http_response object based on the http_request object,
 and send the data through a http_socket object (see http_socket).
 
+Responses are serialized by http_response::write_header into a buffer reused by the connection:
+the status lines and the well-known header names are built once, and the Date value is cached by http_date,
+so writing the header block does not allocate once the buffer is large enough.
+
 */
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <charconv>
 #include <time.h>  
+
+class http_date{//the value of the Date header, formatted at most once per second
+public:
+	static void refresh(){//called by the epoll thread after every wake up, only that thread may call it
+		time_t raw_time = time(NULL);
+		if(raw_time == last_refresh){
+			return;
+		}
+		//write the slot that is not being read, readers are done with it long before it is written again a second later
+		int next = 1 - current.load(std::memory_order_relaxed);
+		format(raw_time, slots[next]);
+		current.store(next, std::memory_order_release);
+		last_refresh = raw_time;
+	}
+	
+	static const char* get(){
+		const char *res = slots[current.load(std::memory_order_acquire)];
+		if(res[0] == 0){//never refreshed (no epoll thread running), format it here
+			thread_local char buffer[DATE_SIZE + 1];
+			format(time(NULL), buffer);
+			return buffer;
+		}
+		return res;
+	}
+	
+	static const int DATE_SIZE = 29;//example Mon, 15 Mar 1995 22:38:34 GMT
+private:
+	inline static char slots[2][DATE_SIZE + 1] = {};
+	inline static std::atomic <int> current{0};
+	inline static time_t last_refresh = 0;
+	
+	static void format(time_t raw_time, char *buffer){
+		struct tm time_info;
+		gmtime_r(&raw_time, &time_info);
+		strftime(buffer, DATE_SIZE + 1, "%a, %d %b %Y %X GMT", &time_info);
+	}
+};
+
 class http_message{
 public:
 	//shared fields
@@ -28,8 +73,8 @@ public:
 				ans.back() += s[i];
 			}
 			else{
-				bool good = true;
-				if(i + match.size() <= s.size()){
+				bool good = i + match.size() <= s.size();//a match cannot run past the end
+				if(good){
 					for(int j = 0; j < match.size(); j++){
 						if(s[i + j] != match[j]){
 							good = false;
@@ -56,13 +101,7 @@ public:
 	static std::string get_server_time(){
 		//get time in RFC 822 / RFC 1123 format
 		//example Mon, 15 Mar 1995 22:38:34 GMT
-		time_t raw_time;
-		struct tm *time_info;
-		char buffer[29];
-		time(&raw_time);
-		time_info = gmtime(&raw_time);
-		strftime(buffer, 80, "%a, %d %b %Y %X GMT", time_info);
-		return buffer;
+		return http_date::get();
 	}
 };
 
@@ -110,35 +149,128 @@ public:
 class http_response: public http_message{//only support html for now
 public:
 	std::string status_code, reason_phrase;
-	http_response(): http_message(), status_code(), reason_phrase(){}
+	std::shared_ptr<const std::string> shared_content;//if set, it is sent as the body instead of content, without being copied
+	http_response(): http_message(), status_code(), reason_phrase(), shared_content(){}
 	
-	std::string get_HTTP(bool allow_default_value = true){//get the HTTP raw to send back for an html file		
-		if(allow_default_value){
-			if(status_code == ""){
-				status_code = "200";
+	const std::string& body() const{
+		return shared_content ? *shared_content : content;
+	}
+	
+	void write_header(std::string &out, bool allow_default_value = true) const{//append the status line and headers, up to and including the empty line
+		const std::string &code = (allow_default_value && status_code == "") ? status_200 : status_code;
+		const std::string &status = status_line(code);
+		if(!status.empty() && (reason_phrase == "" || reason_phrase == reason_of(code))){//prebuilt status line
+			out += status;
+		}
+		else{
+			out += "HTTP/1.1 ";
+			out += code;
+			out += ' ';
+			out += (allow_default_value && reason_phrase == "") ? reason_200 : reason_phrase;
+			out += "\r\n";
+		}
+		
+		for(auto &h: headers){//headers
+			if(allow_default_value && h.first == content_length_name){//always computed from the body
+				continue;
 			}
-			if(reason_phrase == ""){
-				reason_phrase = "OK";
+			out += h.first;
+			out += ": ";
+			out += h.second;
+			out += "\r\n";
+		}
+		
+		if(allow_default_value){
+			if(headers.find(connection_name) == headers.end()){
+				out += "Connection: Keep-Alive\r\n";
 			}
-			if(headers.find("Connection") == headers.end()){
-				headers["Connection"] = "Keep-Alive";			
+			if(headers.find(content_type_name) == headers.end()){
+				out += "Content-Type: text/html; charset=ASCII\r\n";
 			}
-			if(headers.find("Content-Type") == headers.end()){
-				headers["Content-Type"] = "text/html; charset=ASCII";			
+			if(headers.find(date_name) == headers.end()){
+				out += "Date: ";
+				out.append(http_date::get(), http_date::DATE_SIZE);
+				out += "\r\n";
 			}
-			headers["Content-Length"] = std::to_string(content.size());
-		}
-		
-		std::string res = "HTTP/1.1";//Status line
-		res += " " + status_code + " " + reason_phrase + "\r\n";
-		
-		for(auto &h: headers){//headers
-			res += h.first + ": " + h.second + "\r\n";
+			char digits[24];
+			char *end = std::to_chars(digits, digits + sizeof(digits), body().size()).ptr;
+			out += "Content-Length: ";
+			out.append(digits, end - digits);
+			out += "\r\n";
 		}
-		res += "\r\n";
+		out += "\r\n";
+	}
+	
+	std::string get_header(bool allow_default_value = true) const{//get the status line and headers, up to and including the empty line
+		std::string res;
+		write_header(res, allow_default_value);
+		return res;
+	}
+	
+	std::string get_HTTP(bool allow_default_value = true) const{//get the HTTP raw to send back for an html file		
+		std::string res = get_header(allow_default_value);
 		
 		//body
-		res += content;
+		res += body();
 		return res;
 	}
+	
+private:
+	//interned names and values, compared and copied without building a new string each time
+	inline static const std::string connection_name = "Connection";
+	inline static const std::string content_type_name = "Content-Type";
+	inline static const std::string content_length_name = "Content-Length";
+	inline static const std::string date_name = "Date";
+	inline static const std::string status_200 = "200";
+	inline static const std::string reason_200 = "OK";
+	
+	static int code_value(const std::string &code){//-1 if this is not a 3 digits code
+		if(code.size() != 3 || !isdigit(code[0]) || !isdigit(code[1]) || !isdigit(code[2])){
+			return -1;
+		}
+		return (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+	}
+	
+	static const char* reason_of(int code){
+		switch(code){
+			case 200: return "OK";
+			case 201: return "Created";
+			case 204: return "No Content";
+			case 301: return "Moved Permanently";
+			case 302: return "Found";
+			case 304: return "Not Modified";
+			case 400: return "Bad Request";
+			case 403: return "Forbidden";
+			case 404: return "Not Found";
+			case 405: return "Method Not Allowed";
+			case 408: return "Request Timeout";
+			case 413: return "Payload Too Large";
+			case 429: return "Too Many Requests";
+			case 500: return "Internal Server Error";
+			case 501: return "Not Implemented";
+			case 502: return "Bad Gateway";
+			case 503: return "Service Unavailable";
+			case 504: return "Gateway Timeout";
+		}
+		return NULL;
+	}
+	
+	static const char* reason_of(const std::string &code){
+		const char *res = reason_of(code_value(code));
+		return res ? res : "";
+	}
+	
+	static const std::string& status_line(const std::string &code){//prebuilt "HTTP/1.1 <code> <reason>\r\n", empty if the code is unknown
+		static const std::vector <std::string> lines = []{
+			std::vector <std::string> res(600);
+			for(int i = 100; i < 600; i++){
+				if(reason_of(i)){
+					res[i] = "HTTP/1.1 " + std::to_string(i) + " " + reason_of(i) + "\r\n";
+				}
+			}
+			return res;
+		}();
+		int value = code_value(code);
+		return lines[value < 0 ? 0 : value];
+	}
 };
\ No newline at end of file
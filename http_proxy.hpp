@@ -0,0 +1,487 @@
+/*
+This file contains the http_proxy class, a reverse proxy to be used inside a handler.
+
+It forwards the requests whose uri starts with a prefix to a group of upstream servers given as "host:port":
+	-Each upstream keeps a pool of idle keep-alive connections, reused by the next requests instead of reconnecting.
+	-The upstream is picked by round robin, or by the least number of requests in flight to it.
+	-The response is relayed to the client while it is being read, through a small fixed buffer,
+	so large responses are never held in memory. Content-Length, chunked and read-until-close bodies are supported.
+	-The request body was already read by http_socket::receive_message, its raw bytes are sent from the socket's buffer.
+	Chunked request bodies are not supported (http_socket only frames by Content-Length) and get a 501.
+
+Usage, inside handle_request_async (include this file after http_server.hpp, see gallery_server.cpp):
+	http_proxy api("/api/", {"127.0.0.1:8001", "127.0.0.1:8002"}, http_proxy::LEAST_OUTSTANDING);
+	...
+	if(api.matches(sock.request.uri)){
+		auto forwarding = api.forward_async(sock);
+		co_return co_await forwarding;
+	}
+
+A connection failing before anything was sent back gets a 502. Upstream I/O is blocking, with a timeout
+(PROXY_TIMEOUT_MS). forward_async runs it on the proxy's own pool (thread_count threads, one per request in flight),
+so that a slow upstream holds neither an I/O worker nor the server's offload_pool. forward runs it on the calling thread.
+A request is sent again on a new connection only if the reused one was found dead before the request went out,
+or if the method is idempotent, so that a POST is never run twice.
+Interim 1xx responses are read and dropped, Expect is not forwarded since the body is already here.
+Upgrades (101) are not supported and get a 502.
+The response goes back to the client as HTTP/1.1. An HTTP/1.0 upstream connection is only reused if it said Connection: keep-alive.
+*/
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class http_proxy{
+public:
+	enum balancing{ROUND_ROBIN, LEAST_OUTSTANDING};
+
+	http_proxy(const std::string &prefix, const std::vector <std::string> &backends, balancing mode = ROUND_ROBIN,
+	int thread_count = PROXY_THREAD_COUNT):
+	prefix(prefix), mode(mode), next_upstream(0), upstreams(backends.size()),
+	pool(backends.empty() ? 0 : thread_count, BLOCKING_QUEUE_SIZE){//the pool is only used to forward
+		for(size_t i = 0; i < backends.size(); i++){
+			if(!resolve(backends[i], upstreams[i].address)){
+				std::cerr << "cannot resolve upstream " << backends[i] << '\n';
+				exit(-1);
+			}
+		}
+	}
+
+	~http_proxy(){
+		for(auto &u: upstreams){
+			for(int fd: u.idle_fds){
+				close(fd);
+			}
+		}
+	}
+
+	http_proxy(const http_proxy&) = delete;
+	http_proxy& operator=(const http_proxy&) = delete;
+
+	bool matches(const std::string &uri) const{
+		return uri.compare(0, prefix.size(), prefix) == 0;
+	}
+
+	int forward(http_socket &sock){//same return value as handle_request: 0 to keep the client connection, 1 to close it
+		if(upstreams.empty()){
+			sock.send_message(bad_gateway_response);
+			return 0;
+		}
+		if(has_header(sock.request, "transfer-encoding")){//the body was not read, what is left of it is on the connection
+			sock.send_message(not_implemented_response);
+			return 1;
+		}
+		size_t body_size = 0;
+		auto length = sock.request.headers.find("Content-Length");
+		if(length != sock.request.headers.end()){
+			body_size = atoll(length->second.c_str());
+		}
+		if(body_size > 0 && (sock.body_start == 0 || sock.message_size - sock.body_start < body_size)){
+			//the client closed before sending its whole body, never send a shorter one
+			sock.send_message(incomplete_body_response);
+			return 1;
+		}
+		const char *body = sock.buffer + sock.body_start;
+		upstream &u = pick();
+		u.outstanding++;
+		int res = -1;
+		bool idempotent = is_idempotent(sock.request.type);
+		for(int attempt = 0; attempt < 2 && res == -1; attempt++){//an idle connection may have been closed by the upstream meanwhile, retry once on a new one
+			bool reused, request_sent = false;
+			int fd = acquire(u, reused);
+			if(fd < 0){
+				break;
+			}
+			res = exchange(sock, u, fd, body, body_size, request_sent);
+			if(!reused || (request_sent && !idempotent)){//the upstream may have acted on it already
+				break;
+			}
+		}
+		u.outstanding--;
+		if(res == -1){//nothing was sent to the client yet
+			sock.send_message(bad_gateway_response);
+			return 0;
+		}
+		if(res == -2){//failed halfway through the response, the client cannot be told anymore
+			return 1;
+		}
+		return res;
+	}
+	
+	task<int> forward_async(http_socket &sock){//forward on the proxy's pool, the calling worker is handed back meanwhile
+		auto forwarding = pool.run([this, &sock]{//named, gcc 12 destroys lambda temporaries inside a co_await expression twice
+			return forward(sock);
+		});
+		co_return co_await forwarding;
+	}
+
+private:
+	struct upstream{
+		struct sockaddr_in address;
+		std::atomic <int> outstanding{0};//requests in flight
+		std::mutex idle_mutex;
+		std::vector <int> idle_fds;//keep-alive connections ready to be reused
+	};
+
+	const std::string prefix;
+	const balancing mode;
+	std::atomic <unsigned> next_upstream;
+	std::vector <upstream> upstreams;
+	blocking_pool pool;//last, so that its threads are joined before the upstreams go away
+
+	inline static const std::string bad_gateway_response =
+		"HTTP/1.1 502 Bad Gateway\r\nConnection: Keep-Alive\r\nContent-Length: 0\r\n\r\n";
+	inline static const std::string incomplete_body_response =
+		"HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+	inline static const std::string not_implemented_response =
+		"HTTP/1.1 501 Not Implemented\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+	static bool resolve(const std::string &backend, struct sockaddr_in &address){
+		size_t colon = backend.rfind(':');
+		if(colon == std::string::npos){
+			return false;
+		}
+		struct addrinfo hints, *info;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if(getaddrinfo(backend.substr(0, colon).c_str(), backend.substr(colon + 1).c_str(), &hints, &info) != 0){
+			return false;
+		}
+		memcpy(&address, info->ai_addr, sizeof(address));
+		freeaddrinfo(info);
+		return true;
+	}
+
+	upstream& pick(){
+		unsigned start = next_upstream++;
+		if(mode == ROUND_ROBIN){
+			return upstreams[start % upstreams.size()];
+		}
+		//least outstanding, ties are broken by the round robin order so that idle upstreams share the load
+		upstream *best = NULL;
+		for(size_t i = 0; i < upstreams.size(); i++){
+			upstream &u = upstreams[(start + i) % upstreams.size()];
+			if(best == NULL || u.outstanding < best->outstanding){
+				best = &u;
+			}
+		}
+		return *best;
+	}
+
+	int acquire(upstream &u, bool &reused){
+		while(true){
+			int fd;
+			{
+				std::lock_guard <std::mutex> lock(u.idle_mutex);
+				if(u.idle_fds.empty()){
+					break;
+				}
+				fd = u.idle_fds.back();
+				u.idle_fds.pop_back();
+			}
+			char c;
+			if(recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN){//nothing to read and not closed, still usable
+				reused = true;
+				return fd;
+			}
+			close(fd);//closed by the upstream meanwhile (or it sent something unexpected), try the next one
+		}
+		reused = false;
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0){
+			return -1;
+		}
+		struct timeval timeout;
+		timeout.tv_sec = PROXY_TIMEOUT_MS / 1000;
+		timeout.tv_usec = PROXY_TIMEOUT_MS % 1000 * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(connect(fd, (struct sockaddr *)&u.address, sizeof(u.address)) < 0){
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	void release(upstream &u, int fd){//keep the connection for the next request if there is room
+		{
+			std::lock_guard <std::mutex> lock(u.idle_mutex);
+			if(u.idle_fds.size() < PROXY_MAX_IDLE_PER_UPSTREAM){
+				u.idle_fds.push_back(fd);
+				return;
+			}
+		}
+		close(fd);
+	}
+
+	static bool send_all(int fd, const char *data, size_t size){//works for both the blocking upstream and the non blocking client sockets
+		while(size > 0){
+			int count = send(fd, data, size, MSG_NOSIGNAL);
+			if(count < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				if(errno == EAGAIN){//the client is slower than the upstream, wait for it
+					struct pollfd pfd;
+					pfd.fd = fd;
+					pfd.events = POLLOUT;
+					if(poll(&pfd, 1, PROXY_TIMEOUT_MS) > 0 || errno == EINTR){
+						continue;
+					}
+				}
+				return false;
+			}
+			data += count;
+			size -= count;
+		}
+		return true;
+	}
+
+	static bool is_idempotent(const std::string &method){//safe to send twice
+		return method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS" || method == "TRACE";
+	}
+
+	static bool has_header(const http_request &request, const std::string &lower_name){
+		for(auto &h: request.headers){
+			if(to_lower(h.first) == lower_name){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static bool is_hop_by_hop(const std::string &name){//headers that only describe one connection, they are not forwarded
+		static const char *names[] = {"connection", "keep-alive", "proxy-connection", "te", "trailer", "upgrade"};
+		std::string lower = to_lower(name);
+		for(const char *n: names){
+			if(lower == n){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static std::string to_lower(std::string s){
+		for(char &c: s){
+			c = tolower(c);
+		}
+		return s;
+	}
+
+	static std::string request_head(const http_request &request, size_t body_size){
+		std::string res = request.type + " " + request.uri + " HTTP/1.1\r\n";
+		for(auto &h: request.headers){
+			std::string name = to_lower(h.first);
+			if(is_hop_by_hop(h.first) || name == "content-length" || name == "transfer-encoding" || name == "expect"){//the body is sent right away, no 100 Continue needed
+				continue;
+			}
+			res += h.first + ": " + h.second + "\r\n";
+		}
+		if(body_size > 0){
+			res += "Content-Length: " + std::to_string(body_size) + "\r\n";
+		}
+		res += "Connection: Keep-Alive\r\n\r\n";
+		return res;
+	}
+
+	class chunked_scanner{//follow a chunked body as it goes through, to know where it ends
+	public:
+		chunked_scanner(): state(SIZE), remaining(0), line_empty(true){}
+		bool done() const{
+			return state == DONE;
+		}
+		void feed(const char *data, size_t size){
+			for(size_t i = 0; i < size && state != DONE; i++){
+				char c = data[i];
+				if(state == DATA){//skip through the data in one go
+					size_t skip = std::min(remaining, size - i);
+					remaining -= skip;
+					i += skip - 1;
+					if(remaining == 0){
+						state = DATA_END;
+					}
+				}
+				else if(state == SIZE){
+					if(isxdigit(c)){
+						remaining = remaining * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+					}
+					else if(c == ';'){
+						state = SIZE_EXTENSION;
+					}
+					else if(c == '\n'){
+						end_of_size_line();
+					}
+				}
+				else if(state == SIZE_EXTENSION){
+					if(c == '\n'){
+						end_of_size_line();
+					}
+				}
+				else if(state == DATA_END){//the \r\n after the data
+					if(c == '\n'){
+						state = SIZE;
+					}
+				}
+				else if(state == TRAILER){//header lines until an empty one
+					if(c == '\n'){
+						if(line_empty){
+							state = DONE;
+						}
+						line_empty = true;
+					}
+					else if(c != '\r'){
+						line_empty = false;
+					}
+				}
+			}
+		}
+	private:
+		enum{SIZE, SIZE_EXTENSION, DATA, DATA_END, TRAILER, DONE} state;
+		size_t remaining;
+		bool line_empty;
+
+		void end_of_size_line(){
+			state = remaining ? DATA : TRAILER;
+			line_empty = true;
+		}
+	};
+
+	int exchange(http_socket &sock, upstream &u, int fd, const char *body, size_t body_size, bool &request_sent){//forward one request and relay its response
+		//return -1 if nothing was sent to the client, -2 if it failed halfway through, otherwise like forward
+		const http_request &request = sock.request;
+		std::string head = request_head(request, body_size);
+		if(!send_all(fd, head.data(), head.size()) || !send_all(fd, body, body_size)){
+			close(fd);
+			return -1;
+		}
+		request_sent = true;
+
+		//read the status line and headers, skipping interim 1xx responses
+		char buffer[PROXY_BUFFER_SIZE];
+		size_t filled = 0, header_end = 0;
+		while(true){
+			void *found = memmem(buffer, filled, "\r\n\r\n", 4);
+			if(found != NULL){
+				header_end = (char*)found - buffer + 4;
+				int interim_code = filled > 12 ? atoi(buffer + 9) : 0;//"HTTP/1.1 100 Continue"
+				if(interim_code == 101){//the upstream switched protocols, this cannot be relayed
+					close(fd);
+					return -1;
+				}
+				if(interim_code < 100 || interim_code >= 200){//final response
+					break;
+				}
+				memmove(buffer, buffer + header_end, filled - header_end);
+				filled -= header_end;
+				continue;
+			}
+			if(filled == sizeof(buffer)){//headers too large
+				close(fd);
+				return -1;
+			}
+			int count = recv(fd, buffer + filled, sizeof(buffer) - filled, 0);
+			if(count < 0 && errno == EINTR){
+				continue;
+			}
+			if(count <= 0){
+				close(fd);
+				return -1;
+			}
+			filled += count;
+		}
+
+		//framing of the body
+		auto lines = http_message::split(std::string(buffer, header_end), "\r\n");
+		auto status = http_message::split(lines[0], " ", 2);
+		if(status.size() < 2){//not a status line
+			close(fd);
+			return -1;
+		}
+		int code = atoi(status[1].c_str());
+		//HTTP/1.0 closes after the response unless told otherwise, HTTP/1.1 keeps the connection unless told otherwise
+		bool upstream_keep_alive = status[0] != "HTTP/1.0", chunked = false, has_length = false;
+		size_t content_length = 0;
+		std::string response_head = "HTTP/1.1" + lines[0].substr(status[0].size()) + "\r\n";//the client talks to us in HTTP/1.1
+		for(size_t i = 1; i < lines.size(); i++){
+			auto tokens = http_message::split(lines[i], ": ", 1);
+			if(tokens.size() < 2){
+				continue;
+			}
+			std::string name = to_lower(tokens[0]);
+			if(name == "connection"){
+				std::string value = to_lower(tokens[1]);
+				if(value.find("close") != std::string::npos){
+					upstream_keep_alive = false;
+				}
+				else if(value.find("keep-alive") != std::string::npos){
+					upstream_keep_alive = true;
+				}
+			}
+			else if(name == "transfer-encoding" && to_lower(tokens[1]).find("chunked") != std::string::npos){
+				chunked = true;
+			}
+			else if(name == "content-length"){
+				has_length = true;
+				content_length = atoll(tokens[1].c_str());
+			}
+			if(!is_hop_by_hop(tokens[0])){
+				response_head += lines[i] + "\r\n";
+			}
+		}
+		bool no_body = request.type == "HEAD" || code == 204 || code == 304;
+		bool until_close = !no_body && !chunked && !has_length;//the body ends when the upstream closes
+		response_head += until_close ? "Connection: close\r\n\r\n" : "Connection: Keep-Alive\r\n\r\n";
+
+		//relay
+		if(!send_all(sock.fd, response_head.data(), response_head.size())){
+			close(fd);
+			return -2;
+		}
+		if(no_body){
+			upstream_keep_alive ? release(u, fd) : (void)close(fd);
+			return 0;
+		}
+		chunked_scanner scanner;
+		size_t relayed = 0;
+		const char *data = buffer + header_end;
+		size_t size = filled - header_end;
+		while(true){
+			if(!chunked && has_length){
+				size = std::min(size, content_length - relayed);
+			}
+			if(size > 0){
+				if(!send_all(sock.fd, data, size)){
+					close(fd);
+					return -2;
+				}
+				relayed += size;
+				if(chunked){
+					scanner.feed(data, size);
+				}
+			}
+			if((chunked && scanner.done()) || (!chunked && has_length && relayed == content_length)){
+				break;
+			}
+			int count = recv(fd, buffer, sizeof(buffer), 0);
+			if(count < 0 && errno == EINTR){
+				size = 0;
+				continue;
+			}
+			if(count <= 0){
+				close(fd);
+				return until_close && count == 0 ? 1 : -2;//closing is the normal end of a read-until-close body
+			}
+			data = buffer;
+			size = count;
+		}
+		upstream_keep_alive ? release(u, fd) : (void)close(fd);
+		return 0;
+	}
+};
@@ -11,6 +11,20 @@ As epoll's performance is very good with large number of file descriptors, it is
 		+Request arriving.
 		+New connection in the queue
 		+Thread worker finishing and handing back the fds.
+		+Asynchronous handlers finishing after their worker has been handed back (see handle_request_async).
+	-Under overload the epoll thread refuses work early with prebuilt 503/429 responses (see http_admission.hpp).
+
+Stopping and reloading (see handle_signal):
+	-SIGTERM or SIGINT: stop accepting, let the in-flight requests finish, close idle connections and return from start().
+	-SIGHUP: same, but first start the new binary (the command given to enable_reload) and hand it the listening socket.
+	It inherits the fd, told by HTTP_SERVER_LISTEN_FD, so connections are never refused while the old process drains.
+
+Handlers can be written in two ways:
+	-handle_request: synchronous, the worker thread is held until it returns.
+	-handle_request_async: a coroutine (see http_task.hpp). When it co_awaits blocking work sent to offload_pool, a timer,
+	or a socket (io, for example co_await sock.async_send_message(io, response)),
+	its worker is handed back right away so that slow handlers do not starve fast ones.
+	By default it simply calls handle_request.
 
 */
 #include <unistd.h>
@@ -20,9 +34,13 @@ As epoll's performance is very good with large number of file descriptors, it is
 #include <string.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <thread>
+#include <atomic>
 
 #include "http_socket.hpp"
+#include "http_admission.hpp"
 
 class http_server{
 protected:
@@ -44,20 +62,52 @@ protected:
 	
 	
 	int connection_pipe[2];
-	uint8_t thread_response[2] = {0, 1};
+	uint8_t thread_response[3] = {0, 1, 2};//keep, terminate, handler still running (only the worker is handed back)
+	
+	//asynchronous handlers finishing after their worker thread, see handle_fd and finish_request
+	enum{ASYNC_RUNNING, ASYNC_SUSPENDED, ASYNC_DONE};
+	std::atomic <uint8_t> async_state[MAX_FD_VALUE];
+	int async_result[MAX_FD_VALUE];
+	int async_done_pipe[2];
+	
+	blocking_pool offload_pool;//for blocking work inside handlers, co_await offload_pool.run(...)
+	resume_executor resumer;//resumes the handlers woken up by timers and io, never used for blocking work
+	timer_service timers;//co_await timers.sleep_for(...)
+	io_service io;//co_await io.writable(fd), or sock.async_send_message(io, response)
 	std::vector <int> thread_pool;
 	std::queue <int> request_queue;
 	std::queue <int> new_connection_queue;
+	
+	//admission control, only used by the epoll thread
+	admission_control admission;
+	uint32_t client_ip[MAX_FD_VALUE];//set by the accepting thread before the fd is passed on
+	int64_t queued_at[MAX_FD_VALUE];//when the request was put in request_queue
+	
+	//stopping and reloading
+	bool is_idle[MAX_FD_VALUE];//connection waiting in epoll for its next request
+	bool draining;
+	char **reload_argv;
+	int signal_pipe[2];
+	inline static int signal_pipe_write = -1;//for the signal handler, only one server is expected per process
 public:
-	virtual int handle_request(http_socket& sock) = 0;//this function can be implemented to serve html (or other things)
+	virtual int handle_request(http_socket&){//this function can be implemented to serve html (or other things)
+		//only reached when a subclass overrides neither handler, which is a programming error
+		std::cerr << "http_server: override handle_request or handle_request_async\n";
+		abort();
+	}
 	
-	http_server(int port, int max_concurrent_connection = 10000, int max_worker_thread = 16): 
+	virtual task<int> handle_request_async(http_socket& sock){//same contract as handle_request, but can co_await
+		co_return handle_request(sock);
+	}
+	
+	http_server(int port, int max_concurrent_connection = 10000, int max_worker_thread = 16, int max_blocking_thread = 4): 
 	port(port),	max_concurrent_connection(max_concurrent_connection), max_worker_thread(max_worker_thread), 
-	concurrent_connection_count(0),	address_length(sizeof(address))	{
+	concurrent_connection_count(0),	address_length(sizeof(address)),
+	offload_pool(max_blocking_thread, BLOCKING_QUEUE_SIZE), resumer(RESUME_THREAD_COUNT), timers(resumer), io(resumer), is_idle(), draining(false), reload_argv(NULL){
 		for(int i = 0; i < MAX_FD_VALUE; i++){
 			sock[i].set_fd(i);
 		}
-		ep_fd = epoll_create1(0);
+		ep_fd = epoll_create1(EPOLL_CLOEXEC);
 		if(ep_fd < 0){
 			perror("epoll fd create failed!\n");
 			exit(-1);
@@ -65,7 +115,7 @@ public:
 		
 		//create the fd reserved for thread handling
 		for(int i = 0; i<max_worker_thread; i++){
-			if(pipe2(thread_control_fd[i], O_NONBLOCK) < 0){
+			if(pipe2(thread_control_fd[i], O_NONBLOCK | O_CLOEXEC) < 0){
 				perror("failed to create thread pipe");
 				exit(-1);
 			}
@@ -75,53 +125,160 @@ public:
 			pipe_id[thread_control_fd[i][PIPE_WRITE]] = i;
 			thread_pool.push_back(i);
 		}
+		
+		if(pipe2(async_done_pipe, O_NONBLOCK | O_CLOEXEC) < 0){
+			perror("failed to create async handler pipe");
+			exit(-1);
+		}
 	}
 	
 	~http_server(){
 		close(ep_fd);
 	}
-	void start(){//start the server
+	
+	void enable_reload(char *argv[]){//SIGHUP will start this command (usually main's argv) to take over
+		reload_argv = argv;
+	}
+	
+	void start(){//start the server, return once it has been stopped and drained
 		//necessary variable to use linux socket API
-		server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-		if(server_fd < 0){
-			perror("socket create failed");
-			exit(-1);
-		}
-		std::cerr << "server_fd: " << server_fd << '\n';
-		if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))){
-			perror("socketopt failed");
-			exit(-1);
+		const char *inherited_fd = getenv(LISTEN_FD_ENV);
+		if(inherited_fd != NULL){//started by a reload, the old process is still listening on this socket
+			server_fd = atoi(inherited_fd);
+			unsetenv(LISTEN_FD_ENV);
+			fcntl(server_fd, F_SETFD, FD_CLOEXEC);
 		}
-		
-		address.sin_family = AF_INET;
-		address.sin_addr.s_addr = INADDR_ANY;
-		address.sin_port = htons(port);
-		
-		if(bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0){
-			perror("bind failed");
-			exit(-1);
+		else{
+			server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if(server_fd < 0){
+				perror("socket create failed");
+				exit(-1);
+			}
+			if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))){
+				perror("socketopt failed");
+				exit(-1);
+			}
+			
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = INADDR_ANY;
+			address.sin_port = htons(port);
+			
+			if(bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0){
+				perror("bind failed");
+				exit(-1);
+			}
+			
+			if(listen(server_fd, 10000) < 0){//back log is set to 10000, but doesn't really matter
+				perror("listen");
+				exit(-1);
+			}
 		}
+		std::cerr << "server_fd: " << server_fd << '\n';
+		fcntl(server_fd, F_SETFL, O_NONBLOCK);//accept in batches, see the loop below
 		
-		if(listen(server_fd, 10000) < 0){//back log is set to 10000, but doesn't really matter
-			perror("listen");
+		if(pipe2(connection_pipe, O_NONBLOCK | O_CLOEXEC) < 0){
+			perror("failed to create server connection pipe");
 			exit(-1);
 		}
-		
-		if(pipe2(connection_pipe, O_NONBLOCK) < 0){
-			perror("failed to create server connection pipe");
+		if(pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0){
+			perror("failed to create signal pipe");
 			exit(-1);
 		}
+		signal_pipe_write = signal_pipe[PIPE_WRITE];
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = &http_server::on_signal;
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGTERM, &action, NULL);
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGHUP, &action, NULL);
 		
 		std::thread handler(&http_server::handle_connections, this);//thread to handle the connection
+		struct pollfd pfds[2];
+		pfds[0].fd = server_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = signal_pipe[PIPE_READ];
+		pfds[1].events = POLLIN;
 		int new_fd;
 		uint8_t val[2];
 		while(true){
-			new_fd = accept4(server_fd, (struct sockaddr *)&address, (socklen_t*)&address_length, SOCK_NONBLOCK);//accept a new socket in nonblock mode
-			val[0] = new_fd & 255;
-			val[1] = new_fd >> 8;
-			//encoding the socket and send it to the connection thread, this should not fail because it's a local socket
-			write(connection_pipe[PIPE_WRITE], val, 2);
+			//wait for either a connection or a signal, the signal pipe is checked on every pass even when accepting never runs dry
+			if(poll(pfds, 2, -1) < 0){
+				continue;
+			}
+			if((pfds[1].revents & POLLIN) && handle_signal()){
+				break;
+			}
+			for(int i = 0; i < ACCEPT_BATCH; i++){
+				new_fd = accept4(server_fd, (struct sockaddr *)&address, (socklen_t*)&address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);//accept a new socket in nonblock mode
+				if(new_fd < 0){//EAGAIN, nothing left to accept, or an aborted connection
+					break;
+				}
+				client_ip[new_fd] = address.sin_addr.s_addr;
+				val[0] = new_fd & 255;
+				val[1] = new_fd >> 8;
+				//encoding the socket and send it to the connection thread, this should not fail because it's a local socket
+				write(connection_pipe[PIPE_WRITE], val, 2);
+			}
+		}
+		
+		//stop accepting, the connections already accepted are still served
+		close(server_fd);
+		val[0] = DRAIN_CONNECTIONS & 255;
+		val[1] = DRAIN_CONNECTIONS >> 8;
+		write(connection_pipe[PIPE_WRITE], val, 2);
+		handler.join();
+		std::cerr << "server stopped\n";
+	}
+	
+	static void on_signal(int signal){//only forward it to the accepting thread, nothing else is safe here
+		int saved_errno = errno;
+		char c = signal == SIGHUP ? 'r' : 't';
+		write(signal_pipe_write, &c, 1);
+		errno = saved_errno;
+	}
+	
+	bool handle_signal(){//return true if the server should stop
+		char c;
+		if(read(signal_pipe[PIPE_READ], &c, 1) != 1){
+			return false;
 		}
+		if(c == 'r'){
+			if(reload_argv == NULL){
+				std::cerr << "reload is not enabled, ignored\n";
+				return false;
+			}
+			if(!spawn_successor()){
+				perror("failed to start the new server, keep serving");
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	bool spawn_successor(){//start reload_argv with the listening socket inherited
+		int listen_fd = dup(server_fd);//dup does not copy FD_CLOEXEC
+		if(listen_fd < 0){
+			return false;
+		}
+		std::string fd_variable = std::string(LISTEN_FD_ENV) + "=" + std::to_string(listen_fd);
+		std::vector <char*> env;
+		for(char **e = environ; *e != NULL; e++){
+			if(strncmp(*e, LISTEN_FD_ENV "=", strlen(LISTEN_FD_ENV) + 1) != 0){
+				env.push_back(*e);
+			}
+		}
+		env.push_back(&fd_variable[0]);
+		env.push_back(NULL);
+		pid_t pid;
+		int res = posix_spawnp(&pid, reload_argv[0], NULL, NULL, reload_argv, env.data());
+		close(listen_fd);
+		if(res != 0){
+			errno = res;
+			return false;
+		}
+		std::cerr << "started new server, pid " << pid << ", draining\n";
+		return true;
 	}
 	
 	
@@ -134,6 +291,10 @@ public:
 		epoll_ctl(ep_fd, EPOLL_CTL_ADD, connection_pipe[PIPE_READ], &ep_event);
 		current_size++;
 		
+		ep_event.data.fd = async_done_pipe[PIPE_READ];
+		epoll_ctl(ep_fd, EPOLL_CTL_ADD, async_done_pipe[PIPE_READ], &ep_event);
+		current_size++;
+		
 		for(int i = 0; i < max_worker_thread; i++){//poll the read ends of thread handling pipes
 			ep_event.data.fd = thread_control_fd[i][PIPE_READ];
 			epoll_ctl(ep_fd, EPOLL_CTL_ADD, thread_control_fd[i][PIPE_READ], &ep_event);
@@ -144,8 +305,17 @@ public:
 		ep_event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;//edge-trigger and 1 shot for connections
 		uint8_t buffer[8];
 		int new_fd, event_count;
-		while(true){//accept connection and monitor it in epoll
-			event_count = epoll_wait(ep_fd, events, current_size, -1);
+		int64_t drain_start = 0;
+		while(!draining || concurrent_connection_count > 0 || !new_connection_queue.empty()){//accept connection and monitor it in epoll
+			//while draining, connections still queued are waiting for the sweep to free their slot, do not sleep on them
+			event_count = epoll_wait(ep_fd, events, current_size, draining ? (new_connection_queue.empty() ? 1000 : 0) : -1);
+			int64_t now = admission_control::now_us();
+			if(draining && now - drain_start > DRAIN_TIMEOUT_US){
+				//workers and suspended handlers still use sock[] and this, returning would free them underneath
+				std::cerr << "drain timed out with " << concurrent_connection_count << " connections left\n";
+				_exit(1);
+			}
+			http_date::refresh();//keep the Date header current for the workers
 			
 			for(int i = 0; i < event_count; i++){//deal with events
 				if(events[i].data.fd == connection_pipe[PIPE_READ]){
@@ -156,8 +326,26 @@ public:
 						exit(-1);
 					}
 					new_fd = (((int)buffer[1]) << 8) | buffer[0];
-					new_connection_queue.push(new_fd);
-					//saved for later
+					if(new_fd == DRAIN_CONNECTIONS){//the accepting thread stopped
+						draining = true;
+						drain_start = now;
+					}
+					else if(new_connection_queue.size() >= admission.max_pending_connection){//too many waiting already
+						reject_connection(new_fd, admission.overloaded_response);
+					}
+					else{
+						new_connection_queue.push(new_fd);
+						//saved for later
+					}
+				}
+				else if(events[i].data.fd == async_done_pipe[PIPE_READ]){
+					//an asynchronous handler finished after its worker thread was handed back
+					int res = read(events[i].data.fd, buffer, 3);
+					if(res != 3){
+						perror("async handler protocol failed");
+						exit(-1);
+					}
+					release_connection((((int)buffer[1]) << 8) | buffer[0], buffer[2], current_size);
 				}
 				else if(is_thread_control_fd[events[i].data.fd]){//this should be a worker thread finishing
 					int pipe = pipe_id[events[i].data.fd];
@@ -170,35 +358,39 @@ public:
 						exit(-1);
 					}
 					//thread can write back a single byte 0 or 1 to imply whether this fd should be removed or rearmed in polling service
-					if(buffer[0]){//connection terminated, remove the fd
-						concurrent_connection_count--;
-						epoll_ctl(ep_fd, EPOLL_CTL_DEL, connection_fd, NULL);
-						close(connection_fd);//fd will not be closed outside of this place
-					}
-					else{//rearm the fd
-						ep_event.data.fd = connection_fd;
-						epoll_ctl(ep_fd, EPOLL_CTL_MOD, connection_fd, &ep_event);
-						current_size++;
+					//2 means the handler is still running without the thread, the fd will come back through async_done_pipe
+					if(buffer[0] != 2){
+						release_connection(connection_fd, buffer[0], current_size);
 					}
 				}
 				else{//this should be a connection recieving something
+					is_idle[events[i].data.fd] = false;
 					if(events[i].events & EPOLLERR){//error, just close this pipe and ignore this connection
 						cerr << "Error!\n";
-						epoll_ctl(ep_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-						close(events[i].data.fd);
+						release_connection(events[i].data.fd, true, current_size);
 					}
 					else if(events[i].events & EPOLLHUP){
 						cerr << "Hanged up!\n";
-						epoll_ctl(ep_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-						close(events[i].data.fd);
+						release_connection(events[i].data.fd, true, current_size);
+					}
+					else if(!admission.limiter.allow(client_ip[events[i].data.fd], now)){//this client is over its rate
+						drop_connection(events[i].data.fd, admission.rate_limited_response);
+						current_size--;
 					}
 					else{
+						queued_at[events[i].data.fd] = now;
 						request_queue.push(events[i].data.fd);//enqueued to be used later
 						current_size--;
 					}
 				}
 			}
 			
+			if(draining){//after the batch, some of its events may be for idle connections
+				//every pass, since connections still queued below are added as idle and swept on the next pass
+				//(by then epoll has reported those that already sent a request)
+				close_idle_connections(current_size);
+			}
+			
 			while(concurrent_connection_count < max_concurrent_connection){//if the connection count is not maxed, accept new connections
 				if(new_connection_queue.empty()){
 					break;
@@ -211,6 +403,7 @@ public:
 				//add the fd to epoll
 				ep_event.data.fd = new_fd;
 				epoll_ctl(ep_fd, EPOLL_CTL_ADD, new_fd, &ep_event);
+				is_idle[new_fd] = true;
 				current_size++;
 			}
 			//assign connection to worker_thread
@@ -220,15 +413,76 @@ public:
 					break;
 				}
 				
-				int id = thread_pool.back();
-				thread_pool.pop_back();
 				int fd = request_queue.front();
 				request_queue.pop();
+				if(admission.queue_delay.should_shed(now, now - queued_at[fd])){//waited too long, answer right away instead
+					drop_connection(fd, admission.overloaded_response);
+					continue;
+				}
+				int id = thread_pool.back();
+				thread_pool.pop_back();
 				
 				working_fd[id] = fd;
 				std::thread worker(&http_server::handle_fd, this, id, fd);
 				worker.detach();
 			}
+			if(request_queue.empty()){
+				admission.queue_delay.queue_empty(now);
+			}
+		}
+	}
+	
+	void reject_connection(int fd, const std::string &response){//answer with a prebuilt response and close, the fd is not in epoll
+		send(fd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);//best effort, the socket buffer is empty at this point
+		shutdown(fd, SHUT_WR);//the response is followed by a FIN
+		//closing with the request still unread would send a RST, and the client could drop the response with it
+		char discard[4096];
+		for(int i = 0; i < 16; i++){//bounded, this is the epoll thread
+			if(recv(fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0){
+				break;
+			}
+		}
+		close(fd);
+	}
+	
+	void drop_connection(int fd, const std::string &response){//same for a connection in epoll that is not being handled
+		concurrent_connection_count--;
+		epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, NULL);
+		reject_connection(fd, response);
+	}
+	
+	void close_idle_connections(int &current_size){//when draining, a connection waiting for its next request is not given one
+		for(int fd = 0; fd < MAX_FD_VALUE; fd++){
+			if(is_idle[fd]){
+				is_idle[fd] = false;
+				release_connection(fd, true, current_size);
+				current_size--;
+			}
+		}
+	}
+	
+	void release_connection(int connection_fd, bool terminate, int &current_size){//a handler is done with this connection
+		if(terminate || draining){//connection terminated, remove the fd
+			concurrent_connection_count--;
+			epoll_ctl(ep_fd, EPOLL_CTL_DEL, connection_fd, NULL);
+			close(connection_fd);//fd will not be closed outside of this place
+		}
+		else{//rearm the fd
+			ep_event.data.fd = connection_fd;
+			epoll_ctl(ep_fd, EPOLL_CTL_MOD, connection_fd, &ep_event);
+			is_idle[connection_fd] = true;
+			current_size++;
+		}
+	}
+	
+	void finish_request(int fd, int res){//called on whatever thread the handler finished on
+		async_result[fd] = res;
+		if(async_state[fd].exchange(ASYNC_DONE) == ASYNC_SUSPENDED){//the worker is already gone, report to the epoll thread directly
+			uint8_t val[3];
+			val[0] = fd & 255;
+			val[1] = fd >> 8;
+			val[2] = res != 0;
+			write(async_done_pipe[PIPE_WRITE], val, 3);
 		}
 	}
 	
@@ -238,8 +492,14 @@ public:
 			write(thread_control_fd[id][PIPE_WRITE], thread_response + 1, 1);
 		}
 		else{
-			res = handle_request(sock[fd]);
-			if(res == 0){//handler successfully handled the reqest and want to keep the connection going
+			async_state[fd].store(ASYNC_RUNNING);
+			run_detached(handle_request_async(sock[fd]), [this, fd](int res){
+				finish_request(fd, res);
+			});
+			if(async_state[fd].exchange(ASYNC_SUSPENDED) != ASYNC_DONE){//handler is waiting on something, only hand back the thread
+				write(thread_control_fd[id][PIPE_WRITE], thread_response + 2, 1);
+			}
+			else if(async_result[fd] == 0){//handler successfully handled the reqest and want to keep the connection going
 				write(thread_control_fd[id][PIPE_WRITE], thread_response + 0, 1);
 			}
 			else{//handler either refused to answer or want to terminate after answering
@@ -19,11 +19,13 @@ The number of fd can be defined in teh http_define.hpp file
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include "http_define.hpp"
 #include "http_message.hpp"
+#include "http_task.hpp"
 
 class http_socket{
 public:
@@ -32,7 +34,9 @@ public:
 	int buffer_size;
 	char *buffer;
 	struct pollfd *pfds;
-	http_socket(): fd(), request(), buffer_size(SOCKET_STARTING_BUFFER_SIZE){
+	std::string header_buffer;//response headers are written here, it keeps its capacity between responses
+	size_t body_start, message_size;//where the raw body of the last message starts in buffer, and where it ends
+	http_socket(): fd(), request(), buffer_size(SOCKET_STARTING_BUFFER_SIZE), header_buffer(), body_start(0), message_size(0){
 		buffer = new char[buffer_size];;
 		pfds = new struct pollfd[1];
 		pfds[0].events = POLLIN | POLLOUT;
@@ -55,7 +59,7 @@ public:
 		int checked = 3;
 		size_t mss_size = 0;
 		size_t expected_size = -1;
-		size_t body_start = 0;
+		body_start = 0;
 		while(mss_size < expected_size){
 			//entering this loop mean that there's something to do
 			int read_size = read(fd, buffer + mss_size, buffer_size - mss_size);
@@ -64,6 +68,9 @@ public:
 					//poll unitl the read end is ready.
 					//idealistically we can put this back to the epolling thread, but we will poll here for now
 					if(poll(pfds, 1, 30000) < 0){//timed out or error, just drop this connection
+						if(errno == EINTR){//a signal arrived (see http_server::on_signal), wait again
+							continue;
+						}
 						perror("polling");
 						exit(-1);
 					}
@@ -111,12 +118,13 @@ public:
 					}
 					if(body_start){//headers is done
 						expected_size = 0;
+						buffer[mss_size] = 0;//strstr needs it, there is always room since the buffer grows when full
 						char* found = strstr(buffer, "Content-Length: ");//search the string for Content-Length
 						if(found != NULL){//request has a body
 							int pos = found - buffer;
 							pos += 16;
-							while(isdigit(pos)){
-								(expected_size *= 10) += buffer[pos];
+							while(isdigit(buffer[pos])){
+								(expected_size *= 10) += buffer[pos] - '0';
 								pos++;
 							}
 							expected_size += body_start;
@@ -128,6 +136,7 @@ public:
 				}
 			}
 		}
+		message_size = mss_size;
 		if(mss_size){
 			buffer[mss_size] = 0;//nullterminating
 			request.parse(buffer);
@@ -138,12 +147,55 @@ public:
 		return return_value;
 	}
 	
+	static bool wait_writable(int fd){//block until the fd can be written to, instead of spinning on EAGAIN
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		int res;
+		do{
+			res = poll(&pfd, 1, 30000);
+		} while(res < 0 && errno == EINTR);
+		return res > 0 && !(pfd.revents & (POLLERR | POLLHUP));
+	}
+	
+	int send_message(const char *data, size_t size){
+		return send_message(data, size, NULL, 0);
+	}
+	
 	int send_message(const std::string &content){//text/html only for now
-		int res = 0;
-		while(res < content.size()){//make sure to send everything, a poll would be nice but it would not happen for most request 
-			int new_byte = send(fd, &content[res], content.size() - res, 0);
-			if(new_byte == -1){
-				continue;
+		return send_message(content.data(), content.size());
+	}
+	
+	int send_parts(const char *head, size_t head_size, const char *body, size_t body_size, size_t sent){//one non blocking sendmsg of what is left
+		struct iovec iov[2];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		int count = 0;
+		if(sent < head_size){
+			iov[count].iov_base = (void*)(head + sent);
+			iov[count].iov_len = head_size - sent;
+			count++;
+		}
+		size_t body_sent = sent > head_size ? sent - head_size : 0;
+		if(body_sent < body_size){
+			iov[count].iov_base = (void*)(body + body_sent);
+			iov[count].iov_len = body_size - body_sent;
+			count++;
+		}
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	
+	int send_message(const char *head, size_t head_size, const char *body, size_t body_size){//send both parts in one call, without joining them
+		size_t res = 0, total = head_size + body_size;
+		while(res < total){//make sure to send everything, waiting for room when the socket buffer is full
+			int new_byte = send_parts(head, head_size, body, body_size, res);
+			if(new_byte < 0){
+				if(errno == EINTR || (errno == EAGAIN && wait_writable(fd))){
+					continue;
+				}
+				break;//the connection is broken
 			}
 			res += new_byte;
 		}
@@ -151,7 +203,34 @@ public:
 	}
 	
 	int send_message(http_response &response){//text/html only for now
-		return send_message(response.get_HTTP());
+		header_buffer.clear();
+		response.write_header(header_buffer);
+		const std::string &body = response.body();//sent straight from where it is, it can be large
+		return send_message(header_buffer.data(), header_buffer.size(), body.data(), body.size());
+	}
+	
+	task<int> async_send_message(io_service &io, http_response &response){//same, but waits for room without holding the thread
+		header_buffer.clear();
+		response.write_header(header_buffer);
+		const std::string &body = response.body();
+		size_t res = 0, total = header_buffer.size() + body.size();
+		while(res < total){
+			int new_byte = send_parts(header_buffer.data(), header_buffer.size(), body.data(), body.size(), res);
+			if(new_byte < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				if(errno == EAGAIN){
+					uint32_t events = co_await io.writable(fd);
+					if(!(events & (EPOLLERR | EPOLLHUP))){
+						continue;
+					}
+				}
+				break;//the connection is broken
+			}
+			res += new_byte;
+		}
+		co_return res;
 	}
 
 };
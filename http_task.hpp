@@ -0,0 +1,427 @@
+/*
+This file contains the coroutine infrastructure for asynchronous handlers (requires C++20):
+	-task<T>: a lazy coroutine returning T. It starts when it is co_awaited and resumes its awaiter when it is done.
+	-run_detached: start a task from normal code, and call a callback with its result when it is done.
+	-blocking_pool: a fixed set of threads with a bounded queue, for work that blocks (downloads, disk, child processes...).
+	co_await pool.run(fn) runs fn on the pool and resumes the coroutine there with the result.
+	-timer_service: co_await timers.sleep_for(ms) suspends the coroutine without holding a thread.
+	-io_service: co_await io.readable(fd) / io.writable(fd) suspends the coroutine until the fd is ready (see http_socket::async_send_message).
+	-resume_executor: where timer_service and io_service resume their coroutines. Its queue is unbounded so that
+	their threads never wait, and it is kept apart from the blocking_pool so that blocking jobs do not delay wakeups.
+
+A coroutine is resumed on whichever thread completed what it was waiting for, so the code after a co_await
+may run on a different thread than the code before it. The http_socket stays owned by the handler until it co_returns.
+*/
+#include <coroutine>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <class T>
+class task{
+public:
+	struct promise_type{
+		std::optional <T> value;
+		std::coroutine_handle<> continuation;
+
+		task get_return_object(){
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept{//lazy, nothing run until awaited
+			return {};
+		}
+		struct final_awaiter{
+			bool await_ready() noexcept{
+				return false;
+			}
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept{//hand control straight back to the awaiter
+				if(h.promise().continuation){
+					return h.promise().continuation;
+				}
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept{}
+		};
+		final_awaiter final_suspend() noexcept{
+			return {};
+		}
+		void return_value(T v){
+			value.emplace(std::move(v));
+		}
+		void unhandled_exception(){//handlers are not expected to throw, same as the synchronous handle_request
+			std::terminate();
+		}
+	};
+
+	task(task &&other) noexcept: handle(std::exchange(other.handle, nullptr)){}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+	~task(){
+		if(handle){
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept{
+		return false;
+	}
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept{
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+	T await_resume(){
+		return std::move(*handle.promise().value);
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+	explicit task(std::coroutine_handle<promise_type> handle): handle(handle){}
+};
+
+struct detached_task{//fire and forget, the frame frees itself at the end
+	struct promise_type{
+		detached_task get_return_object(){
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept{
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept{
+			return {};
+		}
+		void return_void(){}
+		void unhandled_exception(){
+			std::terminate();
+		}
+	};
+};
+
+template <class T, class F>
+detached_task run_detached(task<T> t, F on_done){//on_done(result) is called on the thread that finishes the task
+	on_done(co_await t);
+}
+
+class blocking_pool{
+public:
+	blocking_pool(int thread_count, size_t max_queue_size): max_queue_size(max_queue_size), stopping(false){
+		for(int i = 0; i < thread_count; i++){
+			threads.emplace_back(&blocking_pool::work, this);
+		}
+	}
+	blocking_pool(const blocking_pool&) = delete;
+	blocking_pool& operator=(const blocking_pool&) = delete;
+
+	~blocking_pool(){//queued jobs are still run before the threads exit
+		{
+			std::lock_guard <std::mutex> lock(queue_mutex);
+			stopping = true;
+		}
+		queue_cv.notify_all();
+		for(auto &t: threads){
+			t.join();
+		}
+	}
+
+	bool try_submit(std::function<void()> job){//return false if the queue is full or there is no thread to run it
+		{
+			std::lock_guard <std::mutex> lock(queue_mutex);
+			if(threads.empty() || stopping || jobs.size() >= max_queue_size){
+				return false;
+			}
+			jobs.push_back(std::move(job));
+		}
+		queue_cv.notify_one();
+		return true;
+	}
+
+	template <class F>
+	class run_awaiter{
+	public:
+		typedef std::invoke_result_t<F&> result_type;
+		static_assert(!std::is_void<result_type>::value, "jobs sent to the blocking_pool must return a value");
+
+		run_awaiter(blocking_pool &pool, F fn): pool(pool), fn(std::move(fn)), result(){}
+		bool await_ready() const noexcept{
+			return false;
+		}
+		bool await_suspend(std::coroutine_handle<> h){
+			//if the pool is saturated, do not suspend and run the job inline instead (the old synchronous behaviour)
+			//once submitted, the job may resume the coroutine before this function returns, so nothing is touched after
+			return pool.try_submit([this, h]{
+				result.emplace(fn());
+				h.resume();
+			});
+		}
+		result_type await_resume(){
+			if(!result){
+				result.emplace(fn());
+			}
+			return std::move(*result);
+		}
+	private:
+		blocking_pool &pool;
+		F fn;
+		std::optional <result_type> result;
+	};
+
+	template <class F>
+	run_awaiter<F> run(F fn){//co_await pool.run(fn) to get fn() computed on the pool
+		return run_awaiter<F>(*this, std::move(fn));
+	}
+
+private:
+	const size_t max_queue_size;
+	bool stopping;
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	std::deque <std::function<void()>> jobs;
+	std::vector <std::thread> threads;
+
+	void work(){
+		while(true){
+			std::function<void()> job;
+			{
+				std::unique_lock <std::mutex> lock(queue_mutex);
+				queue_cv.wait(lock, [this]{
+					return stopping || !jobs.empty();
+				});
+				if(jobs.empty()){//stopping and nothing left to do
+					return;
+				}
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+};
+
+class resume_executor{//a few threads resuming ready coroutines, post never fails nor blocks
+public:
+	resume_executor(int thread_count): stopping(false){
+		for(int i = 0; i < thread_count; i++){
+			threads.emplace_back(&resume_executor::work, this);
+		}
+	}
+	resume_executor(const resume_executor&) = delete;
+	resume_executor& operator=(const resume_executor&) = delete;
+
+	~resume_executor(){//coroutines still queued are dropped, like the pending timers and waits
+		{
+			std::lock_guard <std::mutex> lock(queue_mutex);
+			stopping = true;
+		}
+		queue_cv.notify_all();
+		for(auto &t: threads){
+			t.join();
+		}
+	}
+
+	void post(std::coroutine_handle<> h){
+		{
+			std::lock_guard <std::mutex> lock(queue_mutex);
+			ready.push_back(h);
+		}
+		queue_cv.notify_one();
+	}
+
+private:
+	bool stopping;
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	std::deque <std::coroutine_handle<>> ready;
+	std::vector <std::thread> threads;
+
+	void work(){
+		while(true){
+			std::coroutine_handle<> h;
+			{
+				std::unique_lock <std::mutex> lock(queue_mutex);
+				queue_cv.wait(lock, [this]{
+					return stopping || !ready.empty();
+				});
+				if(stopping){
+					return;
+				}
+				h = ready.front();
+				ready.pop_front();
+			}
+			h.resume();
+		}
+	}
+};
+
+class timer_service{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	timer_service(resume_executor &resumer): resumer(resumer), stopping(false), timers(){
+		thread = std::thread(&timer_service::work, this);
+	}
+	timer_service(const timer_service&) = delete;
+	timer_service& operator=(const timer_service&) = delete;
+
+	~timer_service(){//pending timers are dropped, their coroutines are never resumed
+		{
+			std::lock_guard <std::mutex> lock(timer_mutex);
+			stopping = true;
+		}
+		timer_cv.notify_all();
+		thread.join();
+	}
+
+	class sleep_awaiter{
+	public:
+		sleep_awaiter(timer_service &service, clock::time_point deadline): service(service), deadline(deadline){}
+		bool await_ready() const noexcept{
+			return deadline <= clock::now();
+		}
+		void await_suspend(std::coroutine_handle<> h){
+			service.add(deadline, h);
+		}
+		void await_resume() noexcept{}
+	private:
+		timer_service &service;
+		clock::time_point deadline;
+	};
+
+	sleep_awaiter sleep_for(std::chrono::milliseconds duration){
+		return sleep_awaiter(*this, clock::now() + duration);
+	}
+
+private:
+	typedef std::pair <clock::time_point, std::coroutine_handle<>> timer;
+	struct later{
+		bool operator()(const timer &a, const timer &b) const{
+			return a.first > b.first;
+		}
+	};
+
+	resume_executor &resumer;//expired coroutines are resumed there so that the timer thread is never held up
+	bool stopping;
+	std::mutex timer_mutex;
+	std::condition_variable timer_cv;
+	std::priority_queue <timer, std::vector<timer>, later> timers;
+	std::thread thread;
+
+	void add(clock::time_point deadline, std::coroutine_handle<> h){
+		{
+			std::lock_guard <std::mutex> lock(timer_mutex);
+			timers.push({deadline, h});
+		}
+		timer_cv.notify_one();
+	}
+
+	void work(){
+		std::unique_lock <std::mutex> lock(timer_mutex);
+		while(!stopping){
+			if(timers.empty()){
+				timer_cv.wait(lock);
+				continue;
+			}
+			if(timers.top().first > clock::now()){
+				timer_cv.wait_until(lock, timers.top().first);
+				continue;
+			}
+			std::coroutine_handle<> h = timers.top().second;
+			timers.pop();
+			resumer.post(h);
+		}
+	}
+};
+
+class io_service{//a small epoll of its own, separate from the server's, for coroutines waiting on an fd
+public:
+	io_service(resume_executor &resumer): resumer(resumer){
+		ep_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(ep_fd < 0 || pipe2(stop_pipe, O_NONBLOCK | O_CLOEXEC) < 0){
+			perror("failed to create the io service");
+			exit(-1);
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;//the stop pipe is the only entry without a waiter
+		epoll_ctl(ep_fd, EPOLL_CTL_ADD, stop_pipe[0], &ev);
+		thread = std::thread(&io_service::work, this);
+	}
+	io_service(const io_service&) = delete;
+	io_service& operator=(const io_service&) = delete;
+
+	~io_service(){//pending waits are dropped, their coroutines are never resumed
+		char c = 0;
+		write(stop_pipe[1], &c, 1);
+		thread.join();
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		close(ep_fd);
+	}
+
+	class wait_awaiter{
+	public:
+		wait_awaiter(io_service &service, int fd, uint32_t events): service(service), fd(fd), events(events), revents(0){}
+		bool await_ready() const noexcept{
+			return false;
+		}
+		bool await_suspend(std::coroutine_handle<> h){
+			handle = h;
+			struct epoll_event ev;
+			ev.events = events | EPOLLONESHOT;
+			ev.data.ptr = this;
+			//once added, the io thread may resume the coroutine before this returns, so nothing is touched after
+			if(epoll_ctl(service.ep_fd, EPOLL_CTL_ADD, fd, &ev) < 0){
+				revents = EPOLLERR;
+				return false;
+			}
+			return true;
+		}
+		uint32_t await_resume() noexcept{//the epoll events that fired, EPOLLERR or EPOLLHUP mean the fd is unusable
+			return revents;
+		}
+	private:
+		friend class io_service;
+		io_service &service;
+		int fd;
+		uint32_t events, revents;
+		std::coroutine_handle<> handle;
+	};
+
+	wait_awaiter readable(int fd){
+		return wait_awaiter(*this, fd, EPOLLIN);
+	}
+	wait_awaiter writable(int fd){
+		return wait_awaiter(*this, fd, EPOLLOUT);
+	}
+
+private:
+	resume_executor &resumer;//ready coroutines are resumed there so that the io thread is never held up
+	int ep_fd, stop_pipe[2];
+	std::thread thread;
+
+	void work(){
+		struct epoll_event events[64];
+		while(true){
+			int count = epoll_wait(ep_fd, events, 64, -1);
+			for(int i = 0; i < count; i++){
+				if(events[i].data.ptr == NULL){
+					return;
+				}
+				wait_awaiter *w = (wait_awaiter*)events[i].data.ptr;
+				epoll_ctl(ep_fd, EPOLL_CTL_DEL, w->fd, NULL);//the fd may be waited on again later, by anyone
+				w->revents = events[i].events;
+				resumer.post(w->handle);
+			}
+		}
+	}
+};